@@ -25,29 +25,45 @@
 
 #include <gtk/gtk.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
 #include <string.h>
 
+#include <camel/camel.h>
+
 #include <e-util/e-util.h>
 #include <e-util/e-plugin.h>
 #include <e-util/e-config.h>
 #include <mail/em-config.h>
 #include <mail/em-event.h>
 #include <mail/em-utils.h>
+#include <mail/e-mail-backend.h>
+#include <shell/e-shell.h>
+#include <libemail-engine/e-mail-session.h>
 #include <libevolution-utils/e-alert-dialog.h>
 
+#include "security-marking.h"
+
 #define GSETTINGS_SCHEMA_ID "org.gnome.evolution.plugin.security-classifier"
 #define CHECK_RECIPIENTS_KEY "check-recipients"
 #define DOMAIN_KEY "domain"
+#define CLEARANCE_FILE_KEY "clearance-file"
+#define CHECK_OUTBOX_KEY "check-outbox"
 
 #define EALERT_MESSAGE_PREFIX "org.gnome.evolution.plugins.security_classifier:"
 #define EALERT_CLASSIFY_MESSAGE EALERT_MESSAGE_PREFIX "classify-message"
 #define EALERT_CLASSIFIED_EXTERNAL_RECIPIENT EALERT_MESSAGE_PREFIX "classified-external-recipient"
+#define EALERT_CLASSIFIED_UNCLEARED_RECIPIENT EALERT_MESSAGE_PREFIX "classified-uncleared-recipient"
+#define EALERT_UNKNOWN_CLASSIFICATION EALERT_MESSAGE_PREFIX "unknown-classification"
+#define EALERT_QUEUED_MESSAGES_HELD EALERT_MESSAGE_PREFIX "queued-messages-held"
+#define EALERT_QUEUED_MESSAGES_UNCHECKED EALERT_MESSAGE_PREFIX "queued-messages-unchecked"
 
 
 gint e_plugin_lib_enable (EPlugin *ep, gint enable);
 GtkWidget *e_plugin_lib_get_configure_widget (EPlugin *plugin);
 gboolean init_composer_ui (GtkUIManager *manager, EMsgComposer *composer);
 void org_gnome_evolution_security_classifier (EPlugin *ep, EMEventTargetComposer *t);
+void org_gnome_evolution_security_classifier_replying (EPlugin *ep, EMEventTargetMessage *t);
 
 typedef struct _SecurityLabel
 {
@@ -77,83 +93,164 @@ static const gchar * privacys[] = { N_("AUDIT"),
 
 static gboolean enabled = FALSE;
 
+static void clear_classification_cache (void);
+static void watch_outbox (gboolean watch);
+
 gint
 e_plugin_lib_enable (EPlugin *ep,
                      gint enable)
 {
         enabled = enable;
+        if (!enabled) {
+                clear_classification_cache ();
+        }
+        watch_outbox (enabled);
         return 0;
 }
 
-#define CLASSIFICATION_PATTERN "\\[SEC=([A-Z-]+)(:([A-Z-]+))?\\]"
-
-static gboolean
-strip_classification (gchar *subject)
+/* returns the index into security_labels of security, or -1 if it is not
+   a known classification */
+static gint
+security_level (const gchar *security)
 {
-        GRegex *regex;
-        GMatchInfo *match_info;
-        gboolean ret;
+        const SecurityLabel *label;
+        gint i = 0;
 
-        /* don't use classification regex as is too specific - we want
-           everything inside the SEC= incase it is misformatted - but make
-           non-greedy */
-        regex = g_regex_new ("\\[SEC=.*?\\]", 0, 0, NULL);
-        ret = g_regex_match (regex, subject, 0, &match_info);
-
-        if (ret) {
-                gint start;
-                /* get last occurrence */
-                while (g_match_info_matches (match_info)) {
-                        g_match_info_fetch_pos (match_info, 0, &start, NULL);
-                        g_match_info_next (match_info, NULL);
+        if (!security) {
+                return -1;
+        }
+        for (label = security_labels; label->name; label++, i++) {
+                /* accept both the marking and its translated label */
+                if (!g_ascii_strcasecmp (label->name, security) ||
+                    !g_utf8_collate (gettext (label->name), security)) {
+                        return i;
                 }
-                /* strip off classification subject */
-                subject[start] = '\0';
         }
-        g_match_info_free (match_info);
-        g_regex_unref (regex);
-        return ret;
+        return -1;
 }
 
-typedef struct _Classification
+/* the same subjects get parsed over and over (on composer open, on every
+   subject change and again at presend, across every reply in a thread) so
+   keep a small LRU of parse results shared by all composers */
+#define CLASSIFICATION_CACHE_SIZE 64
+
+typedef struct _CachedClassification
 {
-        gchar *security;
-        gchar *privacy;
-} Classification;
+        gchar *subject;
+        gboolean classified;
+        Classification classification;
+        gchar *stripped;
+} CachedClassification;
+
+G_LOCK_DEFINE_STATIC (classification_cache);
+/* subject -> link in classification_lru, most recently used at the head */
+static GHashTable *classification_cache = NULL;
+static GQueue classification_lru = G_QUEUE_INIT;
+
+static void
+cached_classification_free (CachedClassification *cached)
+{
+        g_free (cached->subject);
+        g_free (cached->classification.security);
+        g_free (cached->classification.privacy);
+        g_free (cached->stripped);
+        g_free (cached);
+}
+
+static void
+clear_classification_cache (void)
+{
+        G_LOCK (classification_cache);
+        if (classification_cache) {
+                g_hash_table_destroy (classification_cache);
+                classification_cache = NULL;
+        }
+        g_queue_foreach (&classification_lru, (GFunc) cached_classification_free,
+                         NULL);
+        g_queue_clear (&classification_lru);
+        G_UNLOCK (classification_cache);
+}
 
 static gboolean
-extract_classification (const gchar *subject,
-                        Classification *classification)
+copy_cached_classification (CachedClassification *cached,
+                            Classification *classification,
+                            gchar **stripped)
+{
+        if (classification) {
+                classification->security = g_strdup (cached->classification.security);
+                classification->privacy = g_strdup (cached->classification.privacy);
+        }
+        if (stripped) {
+                *stripped = g_strdup (cached->stripped);
+        }
+        return cached->classified;
+}
+
+/* as parse_classification() but memoised on subject - the lock is only
+   held to look up and insert entries so parses on other threads aren't
+   serialised behind it */
+static gboolean
+cached_parse_classification (const gchar *subject,
+                             Classification *classification,
+                             gchar **stripped)
 {
-        GRegex *regex;
-        GMatchInfo *match_info;
+        CachedClassification *cached;
+        GList *link;
         gboolean ret;
 
-        regex = g_regex_new (CLASSIFICATION_PATTERN, 0, 0, NULL);
-        ret = g_regex_match (regex, subject, 0, &match_info);
-
-        if (ret) {
-                /* extract classification if required */
-                if (classification) {
-                        /* loop over all matches so we get the last one and keep
-                           it */
-                        gchar *security = NULL;
-                        gchar *privacy = NULL;
-                        while (g_match_info_matches (match_info)) {
-                                /* free any existing versions of security and
-                                   privacy */
-                                g_free (security);
-                                g_free (privacy);
-                                security = g_match_info_fetch (match_info, 1);
-                                privacy = g_match_info_fetch (match_info, 3);
-                                g_match_info_next (match_info, NULL);
-                        }
-                        classification->security = security;
-                        classification->privacy = privacy;
+        if (!subject) {
+                return parse_classification (subject, classification,
+                                             stripped);
+        }
+
+        G_LOCK (classification_cache);
+        link = (classification_cache ?
+                g_hash_table_lookup (classification_cache, subject) : NULL);
+        if (link) {
+                /* move to the front as most recently used */
+                g_queue_unlink (&classification_lru, link);
+                g_queue_push_head_link (&classification_lru, link);
+                ret = copy_cached_classification (link->data, classification,
+                                                  stripped);
+                G_UNLOCK (classification_cache);
+                return ret;
+        }
+        G_UNLOCK (classification_cache);
+
+        cached = g_new0 (CachedClassification, 1);
+        cached->subject = g_strdup (subject);
+        cached->classified = parse_classification (subject,
+                                                   &cached->classification,
+                                                   &cached->stripped);
+        ret = copy_cached_classification (cached, classification, stripped);
+
+        G_LOCK (classification_cache);
+        if (!classification_cache) {
+                /* keys are owned by the cached entries */
+                classification_cache = g_hash_table_new (g_str_hash,
+                                                         g_str_equal);
+        }
+        if (g_hash_table_lookup (classification_cache, subject)) {
+                /* another thread parsed it while we weren't holding the
+                   lock */
+                cached_classification_free (cached);
+        } else {
+                g_queue_push_head (&classification_lru, cached);
+                g_hash_table_insert (classification_cache, cached->subject,
+                                     classification_lru.head);
+
+                /* evict least recently used to keep the cache bounded */
+                while (g_queue_get_length (&classification_lru) >
+                       CLASSIFICATION_CACHE_SIZE) {
+                        CachedClassification *old;
+
+                        old = g_queue_pop_tail (&classification_lru);
+                        g_hash_table_remove (classification_cache, old->subject);
+                        cached_classification_free (old);
                 }
         }
-        g_match_info_free (match_info);
-        g_regex_unref (regex);
+        G_UNLOCK (classification_cache);
+
         return ret;
 }
 
@@ -165,13 +262,9 @@ static void classify (EMsgComposer *composer,
         gchar *subject = NULL, *new_subject = NULL;
 
         header = e_msg_composer_get_header_table (composer);
-        subject = g_strdup (e_composer_header_table_get_subject (header));
-
-        if (extract_classification (subject, NULL)) {
-                strip_classification (subject);
-                /* strip any trailing whitespace too */
-                subject = g_strchomp (subject);
-        }
+        /* strip off any existing markings (and trailing whitespace) */
+        cached_parse_classification (e_composer_header_table_get_subject (header),
+                                     NULL, &subject);
 
         /* get any existing security / privacy */
         if (!security) {
@@ -183,15 +276,8 @@ static void classify (EMsgComposer *composer,
                                              "privacy-classification");
         }
 
-        /* only set if no security label */
-        if (security) {
-                gchar *marking = g_strjoin (":", security, privacy, NULL);
-                /* set this as the classification */
-                new_subject = g_strdup_printf ("%s [SEC=%s]", subject, marking);
-                g_free (marking);
-        } else {
-                new_subject = g_strdup (subject);
-        }
+        /* set this as the classification */
+        new_subject = mark_subject (subject, security, privacy);
         /* set before actually setting subject so we reclassify with same
          * value */
         g_object_set_data_full (G_OBJECT (composer), "security-classification",
@@ -199,8 +285,12 @@ static void classify (EMsgComposer *composer,
         g_object_set_data_full (G_OBJECT (composer), "privacy-classification",
                                 g_strdup (privacy), g_free);
 
-        /* set this new subject */
-        e_composer_header_table_set_subject (header, new_subject);
+        /* set this new subject - unless it is already marked this way so
+         * we don't trigger another round of subject notifications */
+        if (g_strcmp0 (new_subject,
+                       e_composer_header_table_get_subject (header))) {
+                e_composer_header_table_set_subject (header, new_subject);
+        }
 
         g_free (new_subject);
         g_free (subject);
@@ -229,26 +319,128 @@ activate_action (EMsgComposer *composer,
         g_free (downcase_label);
 }
 
+/* selects the radio action for label and the matching entry of combo
+   without running our handlers for either - classification is applied
+   once by the caller instead */
 static void
-subject_changed (EComposerHeaderTable *header,
-                 GParamSpec *pspec,
-                 EMsgComposer *composer)
+select_classification_quietly (EMsgComposer *composer,
+                               const gchar *prefix,
+                               const gchar *label,
+                               gint i,
+                               const gchar *combo_key)
 {
-        const gchar *subject;
+        GtkActionGroup *action_group;
+        GtkComboBox *combo_box;
 
-        subject = e_composer_header_table_get_subject (header);
+        action_group = g_object_get_data (G_OBJECT (composer),
+                                          "classify-action-group");
+        if (action_group) {
+                gchar *downcase_label;
+                gchar *action_name;
+                GtkAction *action;
+
+                downcase_label = g_utf8_strdown (label, -1);
+                action_name = g_strdup_printf ("%s-%s", prefix, downcase_label);
+                action = gtk_action_group_get_action (action_group, action_name);
+                if (action) {
+                        g_signal_handlers_block_matched (action, G_SIGNAL_MATCH_DATA,
+                                                         0, 0, NULL, NULL, composer);
+                        gtk_toggle_action_set_active (GTK_TOGGLE_ACTION (action), TRUE);
+                        g_signal_handlers_unblock_matched (action, G_SIGNAL_MATCH_DATA,
+                                                           0, 0, NULL, NULL, composer);
+                }
+                g_free (action_name);
+                g_free (downcase_label);
+        }
 
+        combo_box = g_object_get_data (G_OBJECT (composer), combo_key);
+        if (combo_box) {
+                g_signal_handlers_block_matched (combo_box, G_SIGNAL_MATCH_DATA,
+                                                 0, 0, NULL, NULL, composer);
+                gtk_combo_box_set_active (combo_box, i);
+                g_signal_handlers_unblock_matched (combo_box, G_SIGNAL_MATCH_DATA,
+                                                   0, 0, NULL, NULL, composer);
+        }
+}
+
+/* sets the composer's classification, menu and combos in one step with at
+   most a single subject rewrite, rather than going via the UI actions.
+   security and privacy may come from untrusted mail so only our own
+   spelling of a known label is ever applied - an unknown privacy is
+   dropped */
+static gboolean
+seed_classification (EMsgComposer *composer,
+                     const gchar *security,
+                     const gchar *privacy)
+{
+        const gchar **p;
+        const gchar *known_privacy = NULL;
+        gint level, i;
+
+        level = security_level (security);
+        /* not worth logging - anyone who can send us mail could fill the
+           log with whatever they put in their marking */
+        if (level < 0) {
+                return FALSE;
+        }
+        select_classification_quietly (composer, "security",
+                                       gettext (security_labels[level].name),
+                                       level, "security-combo");
+
+        if (privacy) {
+                for (p = privacys, i = 0; *p; p++, i++) {
+                        if (!g_ascii_strcasecmp (*p, privacy) ||
+                            !g_utf8_collate (gettext (*p), privacy)) {
+                                select_classification_quietly (composer, "privacy",
+                                                               gettext (*p), i,
+                                                               "privacy-combo");
+                                known_privacy = *p;
+                                break;
+                        }
+                }
+        }
+
+        /* replace rather than merge with any existing privacy */
+        g_object_set_data (G_OBJECT (composer), "privacy-classification", NULL);
+        classify (composer, security_labels[level].name, known_privacy);
+        return TRUE;
+}
+
+/* seeding from the subject waits until idle so that when replying, the
+   message.replying hook - which prefers the x-protective-marking header -
+   gets to seed the composer first and this becomes a no-op */
+static gboolean
+seed_from_subject (EMsgComposer *composer)
+{
+        g_object_set_data (G_OBJECT (composer), "subject-seed-pending", NULL);
         if (!g_object_get_data (G_OBJECT (composer), "security-classification")) {
-                gboolean ret;
+                EComposerHeaderTable *header;
                 Classification classification = { NULL, NULL };
 
-                ret = extract_classification (subject, &classification);
+                header = e_msg_composer_get_header_table (composer);
+                if (cached_parse_classification (e_composer_header_table_get_subject (header),
+                                                 &classification, NULL)) {
+                        seed_classification (composer, classification.security,
+                                             classification.privacy);
+                }
+                g_free (classification.security);
+                g_free (classification.privacy);
+        }
+        g_object_unref (composer);
+        return FALSE;
+}
 
-                if (ret) {
-                        activate_action (composer, "security", classification.security);
-                        if (classification.privacy) {
-                                activate_action (composer, "privacy", classification.privacy);
-                        }
+static void
+subject_changed (EComposerHeaderTable *header,
+                 GParamSpec *pspec,
+                 EMsgComposer *composer)
+{
+        if (!g_object_get_data (G_OBJECT (composer), "security-classification")) {
+                if (!g_object_get_data (G_OBJECT (composer), "subject-seed-pending")) {
+                        g_object_set_data (G_OBJECT (composer), "subject-seed-pending",
+                                           GINT_TO_POINTER (1));
+                        g_idle_add ((GSourceFunc) seed_from_subject,
+                                    g_object_ref (composer));
                 }
         } else {
                 classify (composer, NULL, NULL);
@@ -325,46 +517,331 @@ ask_for_classification (EPlugin *ep,
         return response == GTK_RESPONSE_YES;
 }
 
+/* the clearance table maps recipient addresses to the highest
+   classification they may receive - it is loaded from a local file of
+   "address CLASSIFICATION" lines (a stand in for a directory export) so
+   lookups on send never touch the network, and is reloaded whenever the
+   file changes */
+G_LOCK_DEFINE_STATIC (clearance_table);
+/* lowercased address -> security level + 1 */
+static GHashTable *clearance_table = NULL;
+static gchar *clearance_path = NULL;
+static GFileMonitor *clearance_monitor = NULL;
+/* bumped on every reload so cached verdicts can be invalidated */
+static guint clearance_generation = 0;
+
+/* must be called with the clearance_table lock held */
 static void
-insert_marking_html(gchar **html, const gchar *marking)
-{
-        GRegex *regex = g_regex_new ("<body[^>]*>", G_REGEX_CASELESS, 0, NULL);
-        GMatchInfo *info;
-        gint start, end;
-
-        /* find where <body> tag starts */
-        g_regex_match (regex, *html, 0, &info);
-        if (g_match_info_fetch_pos (info, 0, &start, &end) &&
-            start > 0 && end > start) {
-                gchar *tail = g_strdup (*html + end);
-                gchar *mark = g_strdup_printf ("\n<p><b>%s</b></p>", marking);
-
-                /* if not already marked, insert marking */
-                if (!g_str_has_prefix (tail, mark)) {
-                        gchar *new;
-
-                        /* truncate at end of current <body> tag */
-                        (*html)[end] = '\0';
-                        /* generate new html with our inserted
-                           classification marking */
-                        new = g_strconcat (*html, mark, tail, NULL);
-                        g_free (*html);
-                        *html = new;
+load_clearance_table (void)
+{
+        GMappedFile *mapped;
+        GError *error = NULL;
+        const gchar *line, *end;
+
+        if (clearance_table) {
+                g_hash_table_destroy (clearance_table);
+                clearance_table = NULL;
+        }
+        clearance_generation++;
+
+        if (!clearance_path) {
+                return;
+        }
+        /* always have a table once configured so a missing or unreadable
+           file fails closed rather than disabling the check */
+        clearance_table = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+
+        mapped = g_mapped_file_new (clearance_path, FALSE, &error);
+        if (!mapped) {
+                g_warning ("Unable to load clearance file %s: %s",
+                           clearance_path, error->message);
+                g_error_free (error);
+                return;
+        }
+
+        line = g_mapped_file_get_contents (mapped);
+        end = line + g_mapped_file_get_length (mapped);
+        while (line && line < end) {
+                const gchar *eol, *address, *address_end, *level, *level_end;
+
+                eol = memchr (line, '\n', end - line);
+                if (!eol) {
+                        eol = end;
                 }
-        } else {
-                g_warning ("Unable to find body tag to insert classification marking: %s",
-                           *html);
+
+                address = line;
+                while (address < eol && g_ascii_isspace (*address)) {
+                        address++;
+                }
+                address_end = address;
+                while (address_end < eol && !g_ascii_isspace (*address_end)) {
+                        address_end++;
+                }
+                level = address_end;
+                while (level < eol && g_ascii_isspace (*level)) {
+                        level++;
+                }
+                level_end = level;
+                while (level_end < eol && !g_ascii_isspace (*level_end)) {
+                        level_end++;
+                }
+
+                /* skip blank lines and comments */
+                if (address < address_end && *address != '#') {
+                        gchar *security = g_strndup (level, level_end - level);
+                        gint i = security_level (security);
+
+                        if (i >= 0) {
+                                g_hash_table_insert (clearance_table,
+                                                     g_ascii_strdown (address, address_end - address),
+                                                     GINT_TO_POINTER (i + 1));
+                        } else {
+                                g_warning ("Ignoring unknown clearance '%s' in %s",
+                                           security, clearance_path);
+                        }
+                        g_free (security);
+                }
+                line = eol + 1;
         }
+        g_mapped_file_unref (mapped);
 }
 
 static void
-insert_marking_plain(gchar **plain, const gchar *marking)
+clearance_file_changed (GFileMonitor *monitor,
+                        GFile *file,
+                        GFile *other_file,
+                        GFileMonitorEvent event_type,
+                        gpointer user_data)
+{
+        switch (event_type) {
+        case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+        case G_FILE_MONITOR_EVENT_CREATED:
+        case G_FILE_MONITOR_EVENT_DELETED:
+                G_LOCK (clearance_table);
+                load_clearance_table ();
+                G_UNLOCK (clearance_table);
+                break;
+        default:
+                break;
+        }
+}
+
+/* (re)configure the clearance table from path, an empty path disables
+   clearance checks - must be called from the main thread so the file
+   monitor is attached to the main context */
+static void
+update_clearance_table (const gchar *path)
+{
+        if (path && path[0] == '\0') {
+                path = NULL;
+        }
+
+        G_LOCK (clearance_table);
+        if (g_strcmp0 (path, clearance_path)) {
+                if (clearance_monitor) {
+                        g_file_monitor_cancel (clearance_monitor);
+                        g_object_unref (clearance_monitor);
+                        clearance_monitor = NULL;
+                }
+                g_free (clearance_path);
+                clearance_path = g_strdup (path);
+
+                if (clearance_path) {
+                        GFile *file = g_file_new_for_path (clearance_path);
+                        clearance_monitor = g_file_monitor_file (file,
+                                                                 G_FILE_MONITOR_NONE,
+                                                                 NULL, NULL);
+                        if (clearance_monitor) {
+                                g_signal_connect (clearance_monitor, "changed",
+                                                  G_CALLBACK (clearance_file_changed),
+                                                  NULL);
+                        }
+                        g_object_unref (file);
+                }
+                load_clearance_table ();
+        }
+        G_UNLOCK (clearance_table);
+}
+
+/* returns the security level email is cleared to, or -1 if they have no
+   clearance - returns G_MAXINT when no clearance table is configured so
+   every recipient passes */
+static gint
+lookup_clearance (const gchar *email)
+{
+        gint level = G_MAXINT;
+
+        G_LOCK (clearance_table);
+        if (clearance_table) {
+                gchar *key = g_ascii_strdown (email, -1);
+                level = GPOINTER_TO_INT (g_hash_table_lookup (clearance_table,
+                                                              key)) - 1;
+                g_free (key);
+        }
+        G_UNLOCK (clearance_table);
+        return level;
+}
+
+static guint
+get_clearance_generation (void)
+{
+        guint generation;
+
+        G_LOCK (clearance_table);
+        generation = clearance_generation;
+        G_UNLOCK (clearance_table);
+        return generation;
+}
+
+typedef struct _RecipientVerdict
+{
+        gboolean internal;
+        gint clearance;
+} RecipientVerdict;
+
+static void
+collect_destination_emails (EDestination *destination,
+                            GHashTable *seen,
+                            GPtrArray *emails)
+{
+        if (e_destination_is_evolution_list (destination)) {
+                const GList *l;
+
+                /* recurse into nested lists as their members are what
+                   the message is really delivered to */
+                for (l = e_destination_list_get_dests (destination); l; l = l->next) {
+                        collect_destination_emails (l->data, seen, emails);
+                }
+        } else {
+                const gchar *email = e_destination_get_email (destination);
+
+                /* sometimes there are zero length strings as
+                   destinations so ignore these - and only check each
+                   address once */
+                if (email && email[0] != '\0' &&
+                    !g_hash_table_lookup (seen, email)) {
+                        gchar *copy = g_strdup (email);
+                        g_hash_table_insert (seen, copy, copy);
+                        g_ptr_array_add (emails, copy);
+                }
+        }
+}
+
+/* returns the unique addresses of all destinations with contact lists
+   expanded, owned by the returned array */
+static GPtrArray *
+expand_destinations (EDestination **destinations)
 {
-        if (!g_str_has_prefix(*plain, marking)) {
-                gchar *new = g_strdup_printf ("%s\n\n%s", marking, *plain);
-                g_free (*plain);
-                *plain = new;
+        GHashTable *seen;
+        GPtrArray *emails;
+        EDestination **destination;
+
+        seen = g_hash_table_new (g_str_hash, g_str_equal);
+        emails = g_ptr_array_new_with_free_func (g_free);
+
+        for (destination = destinations; destination && *destination; destination++) {
+                collect_destination_emails (*destination, seen, emails);
         }
+        g_hash_table_destroy (seen);
+        return emails;
+}
+
+/* verdicts are cached per composer so resending after fixing recipients,
+   or re-checking large lists, is a hash lookup per address - the cache is
+   thrown away if the domain or clearance table has since changed */
+static GHashTable *
+get_recipient_verdicts (EMsgComposer *composer,
+                        const gchar *domain)
+{
+        GHashTable *verdicts;
+        const gchar *verdicts_domain;
+        guint generation, verdicts_generation;
+
+        verdicts = g_object_get_data (G_OBJECT (composer), "recipient-verdicts");
+        verdicts_domain = g_object_get_data (G_OBJECT (composer),
+                                             "recipient-verdicts-domain");
+        verdicts_generation = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (composer),
+                                                                   "recipient-verdicts-generation"));
+        generation = get_clearance_generation ();
+        if (!verdicts || g_strcmp0 (verdicts_domain, domain) ||
+            verdicts_generation != generation) {
+                verdicts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+                g_object_set_data_full (G_OBJECT (composer), "recipient-verdicts",
+                                        verdicts,
+                                        (GDestroyNotify) g_hash_table_destroy);
+                g_object_set_data_full (G_OBJECT (composer),
+                                        "recipient-verdicts-domain",
+                                        g_strdup (domain), g_free);
+                g_object_set_data (G_OBJECT (composer),
+                                   "recipient-verdicts-generation",
+                                   GUINT_TO_POINTER (generation));
+        }
+        return verdicts;
+}
+
+G_LOCK_DEFINE_STATIC (recipient_verdicts);
+
+static RecipientVerdict
+lookup_recipient_verdict (GHashTable *verdicts,
+                          const gchar *email,
+                          const gchar *domain)
+{
+        RecipientVerdict *verdict, ret;
+
+        /* the Outbox check shares a cache between its worker threads */
+        G_LOCK (recipient_verdicts);
+        verdict = g_hash_table_lookup (verdicts, email);
+        if (!verdict) {
+                verdict = g_new0 (RecipientVerdict, 1);
+                verdict->internal = address_in_domain (email, domain);
+                verdict->clearance = lookup_clearance (email);
+                g_hash_table_insert (verdicts, g_strdup (email), verdict);
+        }
+        ret = *verdict;
+        G_UNLOCK (recipient_verdicts);
+        return ret;
+}
+
+typedef enum
+{
+        RECIPIENTS_OK,
+        RECIPIENT_EXTERNAL,
+        RECIPIENT_UNCLEARED
+} RecipientsCheck;
+
+/* the recipient policy used by both the composer and the Outbox checks -
+   a message above UNCLASSIFIED may only go to addresses within domain
+   which are cleared to its level. *recipient is set to the first address
+   which may not receive it */
+static RecipientsCheck
+check_recipients (GPtrArray *emails,
+                  gint level,
+                  const gchar *domain,
+                  GHashTable *verdicts,
+                  const gchar **recipient)
+{
+        guint i;
+
+        /* callers must refuse classifications we don't know the level of */
+        g_return_val_if_fail (level >= 0, RECIPIENT_UNCLEARED);
+
+        if (level == 0) {
+                return RECIPIENTS_OK;
+        }
+        for (i = 0; i < emails->len; i++) {
+                const gchar *email = g_ptr_array_index (emails, i);
+                RecipientVerdict verdict;
+
+                verdict = lookup_recipient_verdict (verdicts, email, domain);
+                if (!verdict.internal || verdict.clearance < level) {
+                        *recipient = email;
+                        return (verdict.internal ? RECIPIENT_UNCLEARED :
+                                RECIPIENT_EXTERNAL);
+                }
+        }
+        return RECIPIENTS_OK;
 }
 
 void
@@ -373,8 +850,7 @@ org_gnome_evolution_security_classifier (EPlugin *ep,
 {
         Classification classification = { NULL, NULL };
         GSettings *settings;
-        gchar *u_upcase;
-        gchar *marking, *header;
+        gchar *marking = NULL, *header;
         GtkhtmlEditor *editor = GTKHTML_EDITOR (t->composer);
         EComposerHeaderTable *table;
         ESource *source = NULL;
@@ -382,6 +858,7 @@ org_gnome_evolution_security_classifier (EPlugin *ep,
         ESourceMailIdentity *identity;
         EWebViewGtkHTML *web_view;
         const gchar *uid, *origin;
+        gint level;
 
         table = e_msg_composer_get_header_table (t->composer);
 
@@ -404,54 +881,78 @@ org_gnome_evolution_security_classifier (EPlugin *ep,
                 }
         }
 
+        /* recipients can't be checked against a classification we don't
+           know the level of, so refuse to send it */
+        if (security_level (classification.security) < 0) {
+                EAlert *alert;
+
+                alert = e_alert_new (EALERT_UNKNOWN_CLASSIFICATION,
+                                     classification.security, NULL);
+                e_alert_sink_submit_alert (E_ALERT_SINK (t->composer), alert);
+                g_object_unref (alert);
+                g_object_set_data ((GObject *) t->composer,
+                                   "presend_check_status", GINT_TO_POINTER(1));
+                goto out;
+        }
+
         settings = g_settings_new (GSETTINGS_SCHEMA_ID);
         if (!g_settings_get_boolean (settings, CHECK_RECIPIENTS_KEY)) {
                 goto recipients_ok;
         }
 
         /* if security is NOT unclassified, check recipients are all within the
-         * domain */
-        u_upcase = g_utf8_strup (security_labels[0].name, -1);
-        if (g_utf8_collate (classification.security, u_upcase)) {
-                EDestination **destinations, **destination;
-                gchar *domain;
+         * domain and cleared to receive it */
+        level = security_level (classification.security);
+        if (level > 0) {
+                EDestination **destinations;
+                GPtrArray *emails;
+                RecipientsCheck result;
+                gchar *domain, *clearance_file;
+                const gchar *recipient = NULL;
 
                 domain = g_settings_get_string (settings, DOMAIN_KEY);
+                clearance_file = g_settings_get_string (settings, CLEARANCE_FILE_KEY);
+                update_clearance_table (clearance_file);
+                g_free (clearance_file);
                 destinations = e_composer_header_table_get_destinations (table);
-                destination = destinations;
-
-                while (*destination) {
+                /* expand any contact lists so their members get checked
+                   rather than the list itself */
+                emails = expand_destinations (destinations);
+                result = check_recipients (emails, level, domain,
+                                           get_recipient_verdicts (t->composer, domain),
+                                           &recipient);
+                if (result != RECIPIENTS_OK) {
                         EAlert *alert;
-                        const gchar *email = e_destination_get_email (*destination);
-                        /* sometimes there are zero length strings as
-                           destinations so ignore these */
-                        if (!g_utf8_strlen (email, -1) ||
-                            (g_str_has_suffix (email, domain))) {
-                                destination++;
-                                continue;
+
+                        if (result == RECIPIENT_EXTERNAL) {
+                                alert = e_alert_new (EALERT_CLASSIFIED_EXTERNAL_RECIPIENT,
+                                                     domain, recipient,
+                                                     security_labels[0].name, NULL);
+                        } else {
+                                alert = e_alert_new (EALERT_CLASSIFIED_UNCLEARED_RECIPIENT,
+                                                     recipient,
+                                                     classification.security, NULL);
                         }
-                        alert = e_alert_new (EALERT_CLASSIFIED_EXTERNAL_RECIPIENT,
-                                             domain, email,
-                                             security_labels[0].name, NULL);
                         e_alert_sink_submit_alert (E_ALERT_SINK (t->composer), alert);
                         g_object_unref (alert);
                         g_object_set_data ((GObject *) t->composer,
                                            "presend_check_status", GINT_TO_POINTER(1));
-                        g_free (domain);
-                        goto out;
                 }
+                g_ptr_array_free (emails, TRUE);
                 e_destination_freev (destinations);
                 g_free (domain);
+                if (result != RECIPIENTS_OK) {
+                        g_object_unref (settings);
+                        goto out;
+                }
         }
-        g_free (u_upcase);
 
 recipients_ok:
+        g_object_unref (settings);
         /* classification has been set - insert this at the top of the
          * message if is editable */
         marking = g_strjoin (":", classification.security,
                              classification.privacy, NULL);
-        g_free (classification.security);
-        g_free (classification.privacy);
 
         web_view = e_msg_composer_get_web_view (t->composer);
         if (!e_web_view_gtkhtml_get_editable (web_view)) {
@@ -496,16 +997,575 @@ set_header:
         identity = e_source_get_extension (source,
                                            E_SOURCE_EXTENSION_MAIL_IDENTITY);
         origin = e_source_mail_identity_get_address (identity);
-        header = g_strdup_printf ("VER=2005.6, NS=gov.au, SEC=%s, ORIGIN=%s",
-                                  marking, origin);
+        header = build_protective_marking (classification.security,
+                                           classification.privacy, origin);
         e_msg_composer_set_header (t->composer, "x-protective-marking", header);
         g_free (header);
+        g_object_unref (source);
 
         /* and finally set our version */
         e_msg_composer_set_header (t->composer, "x-" PACKAGE_NAME "-version",
                                    PACKAGE_VERSION);
 out:
-        return;
+        g_free (marking);
+        g_free (classification.security);
+        g_free (classification.privacy);
+}
+
+/* classify a reply straight away from the message being replied to,
+   preferring its x-protective-marking header over its subject - this runs
+   before the idle seed_from_subject () so the composer is seeded once */
+void
+org_gnome_evolution_security_classifier_replying (EPlugin *ep,
+                                                  EMEventTargetMessage *t)
+{
+        Classification classification = { NULL, NULL };
+        const gchar *header;
+
+        if (!enabled || !t->composer || !t->message) {
+                return;
+        }
+
+        header = camel_medium_get_header (CAMEL_MEDIUM (t->message),
+                                          "X-Protective-Marking");
+        if (parse_protective_marking (header, &classification) ||
+            cached_parse_classification (camel_mime_message_get_subject (t->message),
+                                         &classification, NULL)) {
+                seed_classification (t->composer, classification.security,
+                                     classification.privacy);
+        }
+        g_free (classification.security);
+        g_free (classification.privacy);
+}
+
+/* messages queued in the Outbox while offline, or by scripts, never pass
+   through the composer presend checks. there is no hook on the send queue
+   itself, so as soon as the Outbox reports new messages they are moved to
+   Drafts - which takes them out of the send queue - and only the ones
+   which pass are moved back. headers are read on a pool of worker threads
+   and messages which pass are flagged so they aren't held again */
+#define QUEUE_CHECK_THREADS 4
+#define CHECKED_FLAG "security-classifier-checked"
+
+typedef struct _QueueCheck
+{
+        CamelFolder *outbox;
+        CamelFolder *drafts;
+        gchar *domain;
+        gboolean check_recipients;
+        GHashTable *verdicts;
+        gint pending;
+        /* protected by queue_check lock */
+        GPtrArray *passed_uids;
+        GPtrArray *failed_subjects;
+} QueueCheck;
+
+typedef struct _QueueCheckJob
+{
+        QueueCheck *check;
+        gchar *uid;
+        gchar *filename;
+} QueueCheckJob;
+
+G_LOCK_DEFINE_STATIC (queue_check);
+static GThreadPool *queue_check_pool = NULL;
+static CamelFolder *outbox_folder = NULL;
+static gulong outbox_changed_id = 0;
+static guint outbox_watch_id = 0;
+
+static void
+add_address_emails (CamelInternetAddress *address,
+                    GPtrArray *emails)
+{
+        const gchar *email;
+        gint i;
+
+        for (i = 0; address &&
+                     camel_internet_address_get (address, i, NULL, &email); i++) {
+                if (email && email[0] != '\0') {
+                        g_ptr_array_add (emails, g_strdup (email));
+                }
+        }
+}
+
+static void
+add_header_emails (const gchar *header,
+                   GPtrArray *emails)
+{
+        CamelInternetAddress *address;
+
+        if (!header) {
+                return;
+        }
+        address = camel_internet_address_new ();
+        if (camel_address_decode (CAMEL_ADDRESS (address), header) > 0) {
+                add_address_emails (address, emails);
+        }
+        g_object_unref (address);
+}
+
+/* reads just the headers of the queued message in filename, without
+   parsing the rest of the message */
+static gboolean
+read_queued_headers (const gchar *filename,
+                     gchar **subject,
+                     gchar **marking,
+                     GPtrArray *emails)
+{
+        CamelMimeParser *parser;
+        const gchar *header;
+        gboolean ret = FALSE;
+        gint fd;
+
+        if (!filename) {
+                return FALSE;
+        }
+        fd = g_open (filename, O_RDONLY, 0);
+        if (fd == -1) {
+                return FALSE;
+        }
+
+        parser = camel_mime_parser_new ();
+        /* parser takes ownership of fd */
+        camel_mime_parser_init_with_fd (parser, fd);
+        if (camel_mime_parser_step (parser, NULL, NULL) != CAMEL_MIME_PARSER_STATE_EOF) {
+                header = camel_mime_parser_header (parser, "Subject", NULL);
+                *subject = header ? camel_header_decode_string (header, NULL) : NULL;
+                *marking = g_strdup (camel_mime_parser_header (parser,
+                                                               "X-Protective-Marking",
+                                                               NULL));
+                add_header_emails (camel_mime_parser_header (parser, "To", NULL), emails);
+                add_header_emails (camel_mime_parser_header (parser, "Cc", NULL), emails);
+                add_header_emails (camel_mime_parser_header (parser, "Bcc", NULL), emails);
+                /* a redirected message is delivered to its Resent-*
+                   recipients instead */
+                add_header_emails (camel_mime_parser_header (parser, "Resent-To", NULL), emails);
+                add_header_emails (camel_mime_parser_header (parser, "Resent-Cc", NULL), emails);
+                add_header_emails (camel_mime_parser_header (parser, "Resent-Bcc", NULL), emails);
+                ret = TRUE;
+        }
+        g_object_unref (parser);
+        return ret;
+}
+
+/* fallback for stores which can't give us a file per message */
+static gboolean
+read_queued_message (CamelFolder *folder,
+                     const gchar *uid,
+                     gchar **subject,
+                     gchar **marking,
+                     GPtrArray *emails)
+{
+        CamelMimeMessage *message;
+
+        message = camel_folder_get_message_sync (folder, uid, NULL, NULL);
+        if (!message) {
+                return FALSE;
+        }
+        *subject = g_strdup (camel_mime_message_get_subject (message));
+        *marking = g_strdup (camel_medium_get_header (CAMEL_MEDIUM (message),
+                                                      "X-Protective-Marking"));
+        add_address_emails (camel_mime_message_get_recipients (message,
+                                                               CAMEL_RECIPIENT_TYPE_TO),
+                            emails);
+        add_address_emails (camel_mime_message_get_recipients (message,
+                                                               CAMEL_RECIPIENT_TYPE_CC),
+                            emails);
+        add_address_emails (camel_mime_message_get_recipients (message,
+                                                               CAMEL_RECIPIENT_TYPE_BCC),
+                            emails);
+        add_address_emails (camel_mime_message_get_recipients (message,
+                                                               CAMEL_RECIPIENT_TYPE_RESENT_TO),
+                            emails);
+        add_address_emails (camel_mime_message_get_recipients (message,
+                                                               CAMEL_RECIPIENT_TYPE_RESENT_CC),
+                            emails);
+        add_address_emails (camel_mime_message_get_recipients (message,
+                                                               CAMEL_RECIPIENT_TYPE_RESENT_BCC),
+                            emails);
+        g_object_unref (message);
+        return TRUE;
+}
+
+/* applies the same checks as the composer presend hook - the subject must
+   carry a known classification, the x-protective-marking header must agree
+   with it and recipients must pass check_recipients () */
+static gboolean
+queued_message_ok (QueueCheck *check,
+                   const gchar *subject,
+                   const gchar *marking,
+                   GPtrArray *emails)
+{
+        Classification subject_classification = { NULL, NULL };
+        Classification header_classification = { NULL, NULL };
+        const gchar *recipient;
+        gboolean ok;
+        gint level;
+
+        /* parse directly rather than through the cache - each queued
+           subject is seen once and would only evict the composers' */
+        ok = (parse_classification (subject, &subject_classification, NULL) &&
+              parse_protective_marking (marking, &header_classification));
+
+        /* the header must agree with the subject, ignoring case */
+        level = security_level (subject_classification.security);
+        if (level < 0 ||
+            security_level (header_classification.security) != level ||
+            g_ascii_strcasecmp (subject_classification.privacy ?
+                                subject_classification.privacy : "",
+                                header_classification.privacy ?
+                                header_classification.privacy : "")) {
+                ok = FALSE;
+        }
+        if (ok && check->check_recipients) {
+                ok = (check_recipients (emails, level, check->domain,
+                                        check->verdicts, &recipient) == RECIPIENTS_OK);
+        }
+
+        g_free (subject_classification.security);
+        g_free (subject_classification.privacy);
+        g_free (header_classification.security);
+        g_free (header_classification.privacy);
+        return ok;
+}
+
+static void
+queue_check_free (QueueCheck *check)
+{
+        g_object_unref (check->outbox);
+        g_object_unref (check->drafts);
+        g_free (check->domain);
+        g_hash_table_destroy (check->verdicts);
+        g_ptr_array_free (check->passed_uids, TRUE);
+        g_ptr_array_free (check->failed_subjects, TRUE);
+        g_free (check);
+}
+
+static void
+checked_messages_released (GObject *source,
+                           GAsyncResult *result,
+                           gpointer user_data)
+{
+        GError *error = NULL;
+
+        if (!camel_folder_transfer_messages_to_finish (CAMEL_FOLDER (source),
+                                                       result, NULL, &error)) {
+                g_warning ("Unable to move checked messages back to the Outbox: %s",
+                           error->message);
+                g_error_free (error);
+        }
+}
+
+/* queued messages don't belong to any composer so alert in the most
+   recently active window which can show one, without blocking as a
+   dialog would */
+static void
+submit_shell_alert (const gchar *tag,
+                    ...)
+{
+        EShell *shell;
+        EAlert *alert;
+        GList *l;
+        va_list va;
+
+        va_start (va, tag);
+        alert = e_alert_new_valist (tag, va);
+        va_end (va);
+
+        shell = e_shell_get_default ();
+        for (l = shell ? e_shell_get_watched_windows (shell) : NULL; l; l = l->next) {
+                if (E_IS_ALERT_SINK (l->data)) {
+                        e_alert_sink_submit_alert (E_ALERT_SINK (l->data), alert);
+                        break;
+                }
+        }
+        if (!l) {
+                g_warning ("%s", e_alert_get_primary_text (alert));
+        }
+        g_object_unref (alert);
+}
+
+/* called in the main thread once every message in the batch is checked -
+   the ones which passed go back to the Outbox and the rest stay in Drafts */
+static gboolean
+queue_check_done (QueueCheck *check)
+{
+        GString *subjects;
+        guint i;
+
+        /* once disabled leave anything still held in Drafts alone */
+        if (!enabled) {
+                goto out;
+        }
+
+        if (check->passed_uids->len) {
+                for (i = 0; i < check->passed_uids->len; i++) {
+                        camel_folder_set_message_user_flag (check->drafts,
+                                                            check->passed_uids->pdata[i],
+                                                            CHECKED_FLAG, TRUE);
+                }
+                camel_folder_transfer_messages_to (check->drafts, check->passed_uids,
+                                                   check->outbox, TRUE,
+                                                   G_PRIORITY_DEFAULT, NULL,
+                                                   checked_messages_released,
+                                                   NULL);
+        }
+
+        if (check->failed_subjects->len) {
+                subjects = g_string_new (NULL);
+                for (i = 0; i < check->failed_subjects->len; i++) {
+                        g_string_append_printf (subjects, "%s\n",
+                                                (gchar *) g_ptr_array_index (check->failed_subjects, i));
+                }
+                submit_shell_alert (EALERT_QUEUED_MESSAGES_HELD,
+                                    subjects->str, NULL);
+                g_string_free (subjects, TRUE);
+        }
+
+out:
+        queue_check_free (check);
+        return FALSE;
+}
+
+static void
+check_queued_message (QueueCheckJob *job,
+                      gpointer user_data)
+{
+        QueueCheck *check = job->check;
+        gchar *subject = NULL, *marking = NULL;
+        GPtrArray *emails;
+        gboolean ok;
+
+        emails = g_ptr_array_new_with_free_func (g_free);
+        ok = ((read_queued_headers (job->filename, &subject, &marking, emails) ||
+               read_queued_message (check->drafts, job->uid, &subject, &marking, emails)) &&
+              queued_message_ok (check, subject, marking, emails));
+        /* anything we couldn't read or which failed stays held in Drafts */
+        G_LOCK (queue_check);
+        if (ok) {
+                g_ptr_array_add (check->passed_uids, g_strdup (job->uid));
+        } else {
+                g_ptr_array_add (check->failed_subjects,
+                                 g_strdup (subject ? subject : ""));
+        }
+        G_UNLOCK (queue_check);
+        g_ptr_array_free (emails, TRUE);
+        g_free (marking);
+        g_free (subject);
+
+        if (g_atomic_int_dec_and_test (&check->pending)) {
+                g_idle_add ((GSourceFunc) queue_check_done, check);
+        }
+        g_free (job->filename);
+        g_free (job->uid);
+        g_free (job);
+}
+
+/* the queued messages are now out of the send queue so check them */
+static void
+queued_messages_held (GObject *source,
+                      GAsyncResult *result,
+                      gpointer user_data)
+{
+        QueueCheck *check = user_data;
+        GPtrArray *held = NULL;
+        GError *error = NULL;
+        guint i;
+
+        if (!camel_folder_transfer_messages_to_finish (CAMEL_FOLDER (source),
+                                                       result, &held, &error)) {
+                /* some may have been moved and some not, so the user needs
+                   to look in both folders */
+                submit_shell_alert (EALERT_QUEUED_MESSAGES_UNCHECKED,
+                                    error->message, NULL);
+                g_error_free (error);
+                queue_check_free (check);
+                return;
+        }
+        if (!held) {
+                /* they are safely out of the send queue but we can't tell
+                   which drafts they became so leave them there */
+                submit_shell_alert (EALERT_QUEUED_MESSAGES_UNCHECKED,
+                                    _("They could not be found in Drafts after being moved there."),
+                                    NULL);
+                queue_check_free (check);
+                return;
+        }
+
+        /* a store may not know every resulting uid - those stay held */
+        for (i = 0; i < held->len; i++) {
+                if (held->pdata[i]) {
+                        check->pending++;
+                }
+        }
+        if (check->pending < held->len) {
+                submit_shell_alert (EALERT_QUEUED_MESSAGES_UNCHECKED,
+                                    _("Some of them could not be found in Drafts after being moved there."),
+                                    NULL);
+        }
+        /* if we were disabled meanwhile leave them held in Drafts */
+        if (!enabled || !check->pending) {
+                queue_check_free (check);
+                goto out;
+        }
+        if (!queue_check_pool) {
+                queue_check_pool = g_thread_pool_new ((GFunc) check_queued_message,
+                                                      NULL, QUEUE_CHECK_THREADS,
+                                                      FALSE, NULL);
+        }
+        for (i = 0; i < held->len; i++) {
+                QueueCheckJob *job;
+
+                if (!held->pdata[i]) {
+                        continue;
+                }
+                job = g_new0 (QueueCheckJob, 1);
+                job->check = check;
+                job->uid = g_strdup (held->pdata[i]);
+                job->filename = camel_folder_get_filename (check->drafts, job->uid, NULL);
+                g_thread_pool_push (queue_check_pool, job, NULL);
+        }
+out:
+        g_ptr_array_foreach (held, (GFunc) g_free, NULL);
+        g_ptr_array_free (held, TRUE);
+}
+
+static CamelFolder *
+get_local_folder (EMailLocalFolder type)
+{
+        EShell *shell;
+        EShellBackend *backend;
+
+        shell = e_shell_get_default ();
+        backend = shell ? e_shell_get_backend_by_name (shell, "mail") : NULL;
+        if (!backend) {
+                return NULL;
+        }
+        return e_mail_session_get_local_folder (e_mail_backend_get_session (E_MAIL_BACKEND (backend)),
+                                                type);
+}
+
+static void
+hold_queued_messages (CamelFolder *outbox,
+                      GPtrArray *uids)
+{
+        GSettings *settings;
+        QueueCheck *check;
+        CamelFolder *drafts;
+        GPtrArray *queued;
+        gchar *clearance_file;
+        guint i;
+
+        settings = g_settings_new (GSETTINGS_SCHEMA_ID);
+        drafts = get_local_folder (E_MAIL_LOCAL_FOLDER_DRAFTS);
+        if (!g_settings_get_boolean (settings, CHECK_OUTBOX_KEY) || !drafts) {
+                g_object_unref (settings);
+                return;
+        }
+
+        /* skip anything already on its way out of the queue or which we
+           have already checked and put back */
+        queued = g_ptr_array_new ();
+        for (i = 0; i < uids->len; i++) {
+                if (!(camel_folder_get_message_flags (outbox, uids->pdata[i]) &
+                      CAMEL_MESSAGE_DELETED) &&
+                    !camel_folder_get_message_user_flag (outbox, uids->pdata[i],
+                                                         CHECKED_FLAG)) {
+                        g_ptr_array_add (queued, uids->pdata[i]);
+                }
+        }
+        if (!queued->len) {
+                g_ptr_array_free (queued, TRUE);
+                g_object_unref (settings);
+                return;
+        }
+
+        /* read settings and (re)configure the clearance table here in the
+           main thread and hand the workers a snapshot of what they need */
+        clearance_file = g_settings_get_string (settings, CLEARANCE_FILE_KEY);
+        update_clearance_table (clearance_file);
+        g_free (clearance_file);
+
+        check = g_new0 (QueueCheck, 1);
+        check->outbox = g_object_ref (outbox);
+        check->drafts = g_object_ref (drafts);
+        check->domain = g_settings_get_string (settings, DOMAIN_KEY);
+        check->check_recipients = g_settings_get_boolean (settings, CHECK_RECIPIENTS_KEY);
+        check->verdicts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+        check->passed_uids = g_ptr_array_new_with_free_func (g_free);
+        check->failed_subjects = g_ptr_array_new_with_free_func (g_free);
+        g_object_unref (settings);
+
+        camel_folder_transfer_messages_to (outbox, queued, drafts, TRUE,
+                                           G_PRIORITY_HIGH, NULL,
+                                           queued_messages_held, check);
+        g_ptr_array_free (queued, TRUE);
+}
+
+static void
+outbox_changed (CamelFolder *outbox,
+                CamelFolderChangeInfo *changes,
+                gpointer user_data)
+{
+        if (changes && changes->uid_added->len) {
+                hold_queued_messages (outbox, changes->uid_added);
+        }
+}
+
+/* the mail backend and its local folders may not exist yet when we are
+   enabled so keep trying until the Outbox is available */
+static gboolean
+attach_outbox (gpointer user_data)
+{
+        CamelFolder *outbox;
+        GPtrArray *uids;
+
+        outbox = get_local_folder (E_MAIL_LOCAL_FOLDER_OUTBOX);
+        if (!outbox) {
+                return TRUE;
+        }
+
+        outbox_folder = g_object_ref (outbox);
+        outbox_changed_id = g_signal_connect (outbox_folder, "changed",
+                                              G_CALLBACK (outbox_changed), NULL);
+        /* hold anything queued before we started watching */
+        uids = camel_folder_get_uids (outbox_folder);
+        hold_queued_messages (outbox_folder, uids);
+        camel_folder_free_uids (outbox_folder, uids);
+
+        outbox_watch_id = 0;
+        return FALSE;
+}
+
+static void
+watch_outbox (gboolean watch)
+{
+        if (watch) {
+                /* attach straight away if we can to narrow the window in
+                   which mail queued at startup could be sent unchecked */
+                if (!outbox_folder && !outbox_watch_id && attach_outbox (NULL)) {
+                        outbox_watch_id = g_timeout_add_seconds (1, attach_outbox, NULL);
+                }
+                return;
+        }
+
+        if (outbox_watch_id) {
+                g_source_remove (outbox_watch_id);
+                outbox_watch_id = 0;
+        }
+        /* let running checks finish - queue_check_done () then does
+           nothing now that we are disabled */
+        if (queue_check_pool) {
+                g_thread_pool_free (queue_check_pool, FALSE, TRUE);
+                queue_check_pool = NULL;
+        }
+        if (outbox_folder) {
+                g_signal_handler_disconnect (outbox_folder, outbox_changed_id);
+                outbox_changed_id = 0;
+                g_object_unref (outbox_folder);
+                outbox_folder = NULL;
+        }
 }
 
 static void security_action (GtkAction *action, EMsgComposer *composer)
@@ -626,6 +1686,7 @@ init_composer_ui (GtkUIManager *manager,
         action_group = gtk_action_group_new ("security-classifier");
         ui_manager = gtkhtml_editor_get_ui_manager (editor);
         gtk_ui_manager_insert_action_group (ui_manager, action_group, 0);
+        g_object_set_data (G_OBJECT (composer), "classify-action-group", action_group);
         merge_id = gtk_ui_manager_new_merge_id (ui_manager);
 
         /* create the action for the menu */
@@ -737,6 +1798,23 @@ recipients_checkbutton_toggled_cb (GtkToggleButton *button,
                                 check_recipients);
 }
 
+static void
+outbox_checkbutton_toggled_cb (GtkToggleButton *button,
+                               GSettings *settings)
+{
+        gboolean check_outbox = gtk_toggle_button_get_active (button);
+        g_settings_set_boolean (settings, CHECK_OUTBOX_KEY, check_outbox);
+}
+
+static void
+clearance_file_set_cb (GtkFileChooserButton *button,
+                       GSettings *settings)
+{
+        gchar *filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (button));
+        g_settings_set_string (settings, CLEARANCE_FILE_KEY,
+                               filename ? filename : "");
+        g_free (filename);
+}
 
 GtkWidget *
 e_plugin_lib_get_configure_widget (EPlugin *plugin)
@@ -744,7 +1822,10 @@ e_plugin_lib_get_configure_widget (EPlugin *plugin)
         GSettings *settings;
         GtkWidget *recipients_checkbutton;
         GtkWidget *domain_entry;
+        GtkWidget *clearance_button;
+        GtkWidget *outbox_checkbutton;
         GtkWidget *box;
+        gchar *clearance_file;
 
         box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 6);
         gtk_widget_show (box);
@@ -773,6 +1854,32 @@ e_plugin_lib_get_configure_widget (EPlugin *plugin)
                          domain_entry, "sensitive",
                          G_SETTINGS_BIND_GET);
 
+        clearance_button = gtk_file_chooser_button_new (_("Select recipient clearance file"),
+                                                        GTK_FILE_CHOOSER_ACTION_OPEN);
+        clearance_file = g_settings_get_string (settings, CLEARANCE_FILE_KEY);
+        if (clearance_file[0] != '\0') {
+                gtk_file_chooser_set_filename (GTK_FILE_CHOOSER (clearance_button),
+                                               clearance_file);
+        }
+        g_free (clearance_file);
+        gtk_widget_show (clearance_button);
+        gtk_box_pack_start (GTK_BOX (box), clearance_button, TRUE, TRUE, 0);
+        g_signal_connect (clearance_button, "file-set",
+                          G_CALLBACK(clearance_file_set_cb), settings);
+        g_settings_bind (settings, CHECK_RECIPIENTS_KEY,
+                         clearance_button, "sensitive",
+                         G_SETTINGS_BIND_GET);
+
+        outbox_checkbutton = gtk_check_button_new_with_mnemonic (_("_Hold messages queued in the Outbox in Drafts until they are checked"));
+        gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (outbox_checkbutton),
+                                      g_settings_get_boolean (settings,
+                                                              CHECK_OUTBOX_KEY));
+        gtk_widget_show (outbox_checkbutton);
+        gtk_box_pack_start (GTK_BOX (box), outbox_checkbutton, TRUE, TRUE, 0);
+        g_signal_connect (outbox_checkbutton, "toggled",
+                          G_CALLBACK(outbox_checkbutton_toggled_cb),
+                          settings);
+
         g_object_set_data_full (G_OBJECT (box),
                                 "security-classifier-settings",
                                 settings,
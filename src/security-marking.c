@@ -0,0 +1,299 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *
+ * Authors:
+ *                Alex Murray <murray.alex@gmail.com>
+ *
+ *
+ */
+
+/* parsing and generation of protective markings - this only depends on
+   GLib so it can be exercised by the tests and fuzzers without Evolution */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "security-marking.h"
+
+/* don't use classification regex for stripping as is too specific - we want
+   everything inside the SEC= incase it is misformatted - but make
+   non-greedy, and take any whitespace separating it from the subject */
+#define MARKING_PATTERN "\\s*\\[SEC=.*?\\]"
+
+/* compiling is most of the cost of a parse and a GRegex can be shared
+   between threads, so each pattern is compiled once on first use */
+static gpointer
+compile_regex (gpointer pattern)
+{
+        return g_regex_new (pattern, 0, 0, NULL);
+}
+
+static GRegex *
+get_classification_regex (void)
+{
+        static GOnce once = G_ONCE_INIT;
+
+        return g_once (&once, compile_regex, (gpointer) CLASSIFICATION_PATTERN);
+}
+
+static GRegex *
+get_marking_regex (void)
+{
+        static GOnce once = G_ONCE_INIT;
+
+        return g_once (&once, compile_regex, (gpointer) MARKING_PATTERN);
+}
+
+/* returns a copy of subject with every marking (even misformatted ones)
+   and any trailing whitespace removed */
+static gchar *
+strip_markings (const gchar *subject)
+{
+        GRegex *regex;
+        gchar *stripped;
+
+        regex = get_marking_regex ();
+        stripped = g_strdup (subject);
+        /* removing one marking can join the text either side of it into
+           another, so repeat until there are none left - each pass removes
+           at least one marking so this terminates */
+        while (g_regex_match (regex, stripped, 0, NULL)) {
+                gchar *tmp = g_regex_replace_literal (regex, stripped, -1, 0,
+                                                      "", 0, NULL);
+                if (!tmp) {
+                        break;
+                }
+                g_free (stripped);
+                stripped = tmp;
+        }
+        return g_strchomp (stripped);
+}
+
+/* finds the last well formed classification in subject - if stripped is
+   given it is set to subject with all markings removed, ready to be passed
+   to mark_subject(). Subjects which aren't valid UTF-8 are treated as
+   unmarked */
+gboolean
+parse_classification (const gchar *subject,
+                      Classification *classification,
+                      gchar **stripped)
+{
+        GRegex *regex;
+        GMatchInfo *match_info;
+        gboolean ret;
+
+        if (!subject || !g_utf8_validate (subject, -1, NULL)) {
+                if (stripped) {
+                        *stripped = g_strdup (subject ? subject : "");
+                }
+                return FALSE;
+        }
+
+        regex = get_classification_regex ();
+        ret = g_regex_match (regex, subject, 0, &match_info);
+
+        if (ret && classification) {
+                /* loop over all matches so we get the last one and keep
+                   it */
+                gchar *security = NULL;
+                gchar *privacy = NULL;
+                while (g_match_info_matches (match_info)) {
+                        /* free any existing versions of security and
+                           privacy */
+                        g_free (security);
+                        g_free (privacy);
+                        security = g_match_info_fetch (match_info, 1);
+                        privacy = g_match_info_fetch (match_info, 3);
+                        g_match_info_next (match_info, NULL);
+                }
+                /* an unmatched optional group is fetched as an empty
+                   string */
+                if (privacy && privacy[0] == '\0') {
+                        g_free (privacy);
+                        privacy = NULL;
+                }
+                classification->security = security;
+                classification->privacy = privacy;
+        }
+        g_match_info_free (match_info);
+
+        if (stripped) {
+                *stripped = strip_markings (subject);
+        }
+        return ret;
+}
+
+/* appends the marking for security and privacy to a subject already
+   stripped by parse_classification() */
+gchar *
+mark_subject (const gchar *stripped,
+              const gchar *security,
+              const gchar *privacy)
+{
+        gchar *marking;
+        gchar *subject;
+
+        if (!security) {
+                return g_strdup (stripped);
+        }
+        marking = g_strjoin (":", security, privacy, NULL);
+        subject = g_strdup_printf ("%s [SEC=%s]", stripped, marking);
+        g_free (marking);
+        return subject;
+}
+
+/* parses the SEC= field out of an x-protective-marking header such as
+   "VER=2005.6, NS=gov.au, SEC=RESTRICTED:PERSONNEL, ORIGIN=..." - the
+   values are returned as found so callers must validate them */
+gboolean
+parse_protective_marking (const gchar *header,
+                          Classification *classification)
+{
+        gchar **fields, **field;
+        gboolean ret = FALSE;
+
+        if (!header) {
+                return FALSE;
+        }
+
+        fields = g_strsplit (header, ",", -1);
+        for (field = fields; *field && !ret; field++) {
+                gchar *value = g_strstrip (*field);
+
+                if (!g_ascii_strncasecmp (value, "SEC=", 4)) {
+                        gchar **parts = g_strsplit (value + 4, ":", 2);
+
+                        /* headers may be folded around either part */
+                        if (parts[0] && g_strstrip (parts[0])[0] != '\0') {
+                                classification->security = g_strdup (parts[0]);
+                                classification->privacy = (parts[1] && g_strstrip (parts[1])[0] != '\0') ?
+                                        g_strdup (parts[1]) : NULL;
+                                ret = TRUE;
+                        }
+                        g_strfreev (parts);
+                }
+        }
+        g_strfreev (fields);
+        return ret;
+}
+
+/* builds the x-protective-marking header as per Email Protective Marking
+   Standard for the Australian Government October 2005 */
+gchar *
+build_protective_marking (const gchar *security,
+                          const gchar *privacy,
+                          const gchar *origin)
+{
+        gchar *marking;
+        gchar *header;
+
+        marking = g_strjoin (":", security, privacy, NULL);
+        header = g_strdup_printf ("VER=2005.6, NS=gov.au, SEC=%s, ORIGIN=%s",
+                                  marking, origin);
+        g_free (marking);
+        return header;
+}
+
+/* whether email is an address at domain, or one of its subdomains,
+   ignoring case - so for agency.gov.au both x@AGENCY.GOV.AU and
+   x@mail.agency.gov.au are but x@evil-agency.gov.au is not */
+gboolean
+address_in_domain (const gchar *email,
+                   const gchar *domain)
+{
+        const gchar *at, *suffix;
+        gsize email_len, domain_len;
+
+        if (!email || !domain) {
+                return FALSE;
+        }
+        /* accept the domain written as @agency.gov.au too */
+        if (domain[0] == '@') {
+                domain++;
+        }
+
+        at = strrchr (email, '@');
+        email_len = strlen (email);
+        domain_len = strlen (domain);
+        if (!at || domain_len == 0 || email_len <= domain_len) {
+                return FALSE;
+        }
+
+        suffix = email + email_len - domain_len;
+        if (g_ascii_strcasecmp (suffix, domain)) {
+                return FALSE;
+        }
+        /* must match whole labels of the part after the @ */
+        return (suffix - 1 == at) || (suffix - 1 > at && suffix[-1] == '.');
+}
+
+void
+insert_marking_html (gchar **html, const gchar *marking)
+{
+        GRegex *regex;
+        GMatchInfo *info;
+        gint start = -1, end = -1;
+
+        if (!*html || !g_utf8_validate (*html, -1, NULL)) {
+                return;
+        }
+
+        regex = g_regex_new ("<body[^>]*>", G_REGEX_CASELESS, 0, NULL);
+        /* find where <body> tag starts */
+        if (g_regex_match (regex, *html, 0, &info) &&
+            g_match_info_fetch_pos (info, 0, &start, &end) &&
+            start >= 0 && end > start) {
+                gchar *escaped = g_markup_escape_text (marking, -1);
+                gchar *mark = g_strdup_printf ("\n<p><b>%s</b></p>", escaped);
+
+                /* if not already marked, insert marking */
+                if (!g_str_has_prefix (*html + end, mark)) {
+                        gchar *head;
+                        gchar *new;
+
+                        /* copy up to end of current <body> tag rather than
+                           truncating the caller's buffer */
+                        head = g_strndup (*html, end);
+                        /* generate new html with our inserted
+                           classification marking */
+                        new = g_strconcat (head, mark, *html + end, NULL);
+                        g_free (head);
+                        g_free (*html);
+                        *html = new;
+                }
+                g_free (mark);
+                g_free (escaped);
+        } else {
+                g_warning ("Unable to find body tag to insert classification marking: %s",
+                           *html);
+        }
+        g_match_info_free (info);
+        g_regex_unref (regex);
+}
+
+void
+insert_marking_plain (gchar **plain, const gchar *marking)
+{
+        if (!*plain) {
+                *plain = g_strdup (marking);
+        } else if (!g_str_has_prefix(*plain, marking)) {
+                gchar *new = g_strdup_printf ("%s\n\n%s", marking, *plain);
+                g_free (*plain);
+                *plain = new;
+        }
+}
@@ -0,0 +1,56 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *
+ * Authors:
+ *                Alex Murray <murray.alex@gmail.com>
+ *
+ *
+ */
+
+#ifndef SECURITY_MARKING_H
+#define SECURITY_MARKING_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* protective markings as they appear in subjects, eg. [SEC=RESTRICTED] or
+   [SEC=IN-CONFIDENCE:PERSONNEL] */
+#define CLASSIFICATION_PATTERN "\\[SEC=([A-Z-]+)(:([A-Z-]+))?\\]"
+
+typedef struct _Classification
+{
+        gchar *security;
+        gchar *privacy;
+} Classification;
+
+gboolean parse_classification (const gchar *subject,
+                               Classification *classification,
+                               gchar **stripped);
+gchar *mark_subject (const gchar *stripped,
+                     const gchar *security,
+                     const gchar *privacy);
+gboolean parse_protective_marking (const gchar *header,
+                                   Classification *classification);
+gchar *build_protective_marking (const gchar *security,
+                                 const gchar *privacy,
+                                 const gchar *origin);
+gboolean address_in_domain (const gchar *email, const gchar *domain);
+void insert_marking_html (gchar **html, const gchar *marking);
+void insert_marking_plain (gchar **plain, const gchar *marking);
+
+G_END_DECLS
+
+#endif /* SECURITY_MARKING_H */
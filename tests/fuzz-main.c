@@ -0,0 +1,84 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *
+ * Authors:
+ *                Alex Murray <murray.alex@gmail.com>
+ *
+ *
+ */
+
+/* standalone driver for the fuzz targets: with arguments each names an
+   input file to run (so AFL can use "@@"), without any every file in the
+   target's seed corpus is run */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "fuzz.h"
+
+static gboolean
+run_file (const gchar *filename)
+{
+        GError *error = NULL;
+        gchar *contents;
+        gsize length;
+
+        if (!g_file_get_contents (filename, &contents, &length, &error)) {
+                g_printerr ("Unable to read %s: %s\n", filename, error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+        LLVMFuzzerTestOneInput ((const uint8_t *) contents, length);
+        g_free (contents);
+        return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+        GError *error = NULL;
+        GDir *dir;
+        const gchar *name;
+        gint i, ret = 0;
+
+        if (argc > 1) {
+                for (i = 1; i < argc; i++) {
+                        if (!run_file (argv[i])) {
+                                ret = 1;
+                        }
+                }
+                return ret;
+        }
+
+        dir = g_dir_open (CORPUS_DIR, 0, &error);
+        if (!dir) {
+                g_printerr ("Unable to open corpus %s: %s\n", CORPUS_DIR,
+                            error->message);
+                g_error_free (error);
+                return 1;
+        }
+        while ((name = g_dir_read_name (dir))) {
+                gchar *filename = g_build_filename (CORPUS_DIR, name, NULL);
+                if (!run_file (filename)) {
+                        ret = 1;
+                }
+                g_free (filename);
+        }
+        g_dir_close (dir);
+        return ret;
+}
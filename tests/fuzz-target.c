@@ -0,0 +1,47 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *
+ * Authors:
+ *                Alex Murray <murray.alex@gmail.com>
+ *
+ *
+ */
+
+/* fuzzes one of the marking parsers - built once per target with FUZZ_CHECK
+   set to the check_*_properties() function to feed the input to */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "fuzz.h"
+#include "marking-properties.h"
+
+#ifndef FUZZ_CHECK
+#error "FUZZ_CHECK must name the check_*_properties () function to fuzz"
+#endif
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+        /* inputs are NUL terminated strings so stop at any embedded NUL */
+        gchar *input = g_strndup ((const gchar *) data, size);
+
+        FUZZ_CHECK (input);
+        g_free (input);
+        return 0;
+}
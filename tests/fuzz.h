@@ -0,0 +1,33 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *
+ * Authors:
+ *                Alex Murray <murray.alex@gmail.com>
+ *
+ *
+ */
+
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* libFuzzer entry point, implemented by fuzz-target.c - when not
+   building with --enable-fuzzing fuzz-main.c drives it instead so targets
+   can be run under AFL or replayed over their corpus by make check */
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size);
+
+#endif /* FUZZ_H */
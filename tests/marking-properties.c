@@ -0,0 +1,196 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *
+ * Authors:
+ *                Alex Murray <murray.alex@gmail.com>
+ *
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "security-marking.h"
+#include "marking-properties.h"
+
+#define LABEL_PATTERN "^[A-Z-]+$"
+#define ANY_MARKING_PATTERN "\\[SEC=.*?\\]"
+#define BODY_PATTERN "<body[^>]*>"
+
+static void
+assert_classification_equal (const Classification *a,
+                             const Classification *b)
+{
+        g_assert_cmpstr (a->security, ==, b->security);
+        g_assert_cmpstr (a->privacy, ==, b->privacy);
+}
+
+void
+check_subject_properties (const gchar *subject)
+{
+        Classification classification = { NULL, NULL };
+        Classification reparsed = { NULL, NULL };
+        gchar *stripped = NULL, *again = NULL, *marked, *remarked = NULL;
+        gboolean ret;
+
+        ret = parse_classification (subject, &classification, &stripped);
+        g_assert (stripped != NULL);
+
+        if (!g_utf8_validate (subject, -1, NULL)) {
+                /* non UTF-8 subjects are left well alone */
+                g_assert (!ret);
+                g_assert_cmpstr (stripped, ==, subject);
+                g_free (stripped);
+                return;
+        }
+
+        /* stripping removes every marking and is idempotent */
+        g_assert (!g_regex_match_simple (ANY_MARKING_PATTERN, stripped, 0, 0));
+        g_assert (!parse_classification (stripped, NULL, &again));
+        g_assert_cmpstr (again, ==, stripped);
+        g_free (again);
+
+        if (!ret) {
+                g_assert (classification.security == NULL);
+                g_assert (classification.privacy == NULL);
+                g_free (stripped);
+                return;
+        }
+
+        g_assert (g_regex_match_simple (LABEL_PATTERN, classification.security, 0, 0));
+        g_assert (classification.privacy == NULL ||
+                  g_regex_match_simple (LABEL_PATTERN, classification.privacy, 0, 0));
+
+        /* classifying the stripped subject then extracting gives back the
+           same classification, and stripping that gives no markings */
+        marked = mark_subject (stripped, classification.security,
+                               classification.privacy);
+        g_assert (parse_classification (marked, &reparsed, &remarked));
+        assert_classification_equal (&classification, &reparsed);
+        g_assert (!g_regex_match_simple (ANY_MARKING_PATTERN, remarked, 0, 0));
+
+        g_free (remarked);
+        g_free (reparsed.security);
+        g_free (reparsed.privacy);
+        g_free (marked);
+        g_free (classification.security);
+        g_free (classification.privacy);
+        g_free (stripped);
+}
+
+void
+check_header_properties (const gchar *header)
+{
+        Classification classification = { NULL, NULL };
+        Classification reparsed = { NULL, NULL };
+        gchar *rebuilt;
+
+        if (!parse_protective_marking (header, &classification)) {
+                g_assert (classification.security == NULL);
+                g_assert (classification.privacy == NULL);
+                return;
+        }
+
+        g_assert (classification.security != NULL);
+        g_assert_cmpstr (classification.security, !=, "");
+        g_assert (strchr (classification.security, ',') == NULL);
+        g_assert (strchr (classification.security, ':') == NULL);
+        g_assert (classification.privacy == NULL ||
+                  (classification.privacy[0] != '\0' &&
+                   strchr (classification.privacy, ',') == NULL));
+
+        /* building a header from what was parsed then parsing it again is
+           the identity */
+        rebuilt = build_protective_marking (classification.security,
+                                            classification.privacy,
+                                            "origin@example.com");
+        g_assert (parse_protective_marking (rebuilt, &reparsed));
+        assert_classification_equal (&classification, &reparsed);
+
+        g_free (rebuilt);
+        g_free (reparsed.security);
+        g_free (reparsed.privacy);
+        g_free (classification.security);
+        g_free (classification.privacy);
+}
+
+static void
+check_html_properties (const gchar *body,
+                       const gchar *marking)
+{
+        gchar *html, *again, *escaped, *mark;
+
+        html = g_strdup (body);
+        if (!g_utf8_validate (body, -1, NULL)) {
+                /* invalid html is left untouched */
+                insert_marking_html (&html, marking);
+                g_assert_cmpstr (html, ==, body);
+                g_free (html);
+                return;
+        }
+        if (!g_regex_match_simple (BODY_PATTERN, body, G_REGEX_CASELESS, 0)) {
+                /* nowhere to insert - this only warns */
+                g_free (html);
+                return;
+        }
+
+        insert_marking_html (&html, marking);
+        escaped = g_markup_escape_text (marking, -1);
+        mark = g_strdup_printf ("\n<p><b>%s</b></p>", escaped);
+        g_assert (strstr (html, mark) != NULL);
+        /* nothing of the original is lost */
+        g_assert_cmpuint (strlen (html), >=, strlen (body));
+
+        /* inserting again is a no-op */
+        again = g_strdup (html);
+        insert_marking_html (&again, marking);
+        g_assert_cmpstr (again, ==, html);
+
+        g_free (again);
+        g_free (mark);
+        g_free (escaped);
+        g_free (html);
+}
+
+static void
+check_plain_properties (const gchar *body,
+                        const gchar *marking)
+{
+        gchar *plain, *again;
+
+        plain = g_strdup (body);
+        insert_marking_plain (&plain, marking);
+        g_assert (g_str_has_prefix (plain, marking));
+        g_assert (g_str_has_suffix (plain, body));
+
+        again = g_strdup (plain);
+        insert_marking_plain (&again, marking);
+        g_assert_cmpstr (again, ==, plain);
+
+        g_free (again);
+        g_free (plain);
+}
+
+void
+check_body_properties (const gchar *body)
+{
+        check_html_properties (body, "RESTRICTED:PERSONNEL");
+        /* markings are escaped rather than trusted to be markup */
+        check_html_properties (body, "<b>&\"'");
+        check_plain_properties (body, "IN-CONFIDENCE");
+}
@@ -0,0 +1,38 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *
+ * Authors:
+ *                Alex Murray <murray.alex@gmail.com>
+ *
+ *
+ */
+
+#ifndef MARKING_PROPERTIES_H
+#define MARKING_PROPERTIES_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* invariants of the marking parsers which must hold for any input - these
+   abort via g_assert*() when violated so are shared by the unit tests and
+   the fuzz targets */
+void check_subject_properties (const gchar *subject);
+void check_header_properties (const gchar *header);
+void check_body_properties (const gchar *body);
+
+G_END_DECLS
+
+#endif /* MARKING_PROPERTIES_H */
@@ -0,0 +1,289 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *
+ * Authors:
+ *                Alex Murray <murray.alex@gmail.com>
+ *
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "security-marking.h"
+#include "marking-properties.h"
+
+static const gchar *securities[] = { "UNCLASSIFIED",
+                                     "IN-CONFIDENCE",
+                                     "RESTRICTED",
+                                     NULL };
+
+static const gchar *privacys[] = { NULL, /* no privacy */
+                                   "AUDIT",
+                                   "PERSONNEL",
+                                   "STAFF" };
+
+typedef struct _SubjectExample
+{
+        const gchar *subject;
+        gboolean classified;
+        const gchar *security;
+        const gchar *privacy;
+        const gchar *stripped;
+} SubjectExample;
+
+static const SubjectExample subject_examples[] = {
+        { "Weekly ops [SEC=IN-CONFIDENCE]", TRUE, "IN-CONFIDENCE", NULL, "Weekly ops" },
+        { "Re: Weekly ops [SEC=RESTRICTED:PERSONNEL]", TRUE, "RESTRICTED", "PERSONNEL", "Re: Weekly ops" },
+        { "[SEC=UNCLASSIFIED]", TRUE, "UNCLASSIFIED", NULL, "" },
+        /* last well formed marking wins */
+        { "a [SEC=RESTRICTED] b [SEC=IN-CONFIDENCE]", TRUE, "IN-CONFIDENCE", NULL, "a b" },
+        /* misformatted markings are stripped along with well formed ones */
+        { "foo [SEC=RESTRICTED] [SEC=junk]", TRUE, "RESTRICTED", NULL, "foo" },
+        { "foo [SEC=junk]", FALSE, NULL, NULL, "foo" },
+        { "[Fwd: report [SEC=RESTRICTED]]", TRUE, "RESTRICTED", NULL, "[Fwd: report]" },
+        /* stripping one marking must not leave another behind */
+        { "[SE[SEC=x]C=y]", FALSE, NULL, NULL, "" },
+        { "no marking here  ", FALSE, NULL, NULL, "no marking here" },
+        { "", FALSE, NULL, NULL, "" },
+};
+
+static void
+test_subject_examples (void)
+{
+        guint i;
+
+        for (i = 0; i < G_N_ELEMENTS (subject_examples); i++) {
+                const SubjectExample *example = &subject_examples[i];
+                Classification classification = { NULL, NULL };
+                gchar *stripped = NULL;
+
+                g_assert_cmpint (parse_classification (example->subject,
+                                                       &classification,
+                                                       &stripped),
+                                 ==, example->classified);
+                g_assert_cmpstr (classification.security, ==, example->security);
+                g_assert_cmpstr (classification.privacy, ==, example->privacy);
+                g_assert_cmpstr (stripped, ==, example->stripped);
+                check_subject_properties (example->subject);
+
+                g_free (stripped);
+                g_free (classification.security);
+                g_free (classification.privacy);
+        }
+}
+
+static void
+test_subject_invalid_utf8 (void)
+{
+        Classification classification = { NULL, NULL };
+        gchar *stripped = NULL;
+
+        g_assert (!parse_classification ("\xff [SEC=RESTRICTED]",
+                                         &classification, &stripped));
+        g_assert_cmpstr (stripped, ==, "\xff [SEC=RESTRICTED]");
+        g_assert (classification.security == NULL);
+        g_free (stripped);
+
+        g_assert (!parse_classification (NULL, NULL, &stripped));
+        g_assert_cmpstr (stripped, ==, "");
+        g_free (stripped);
+}
+
+static void
+test_subject_round_trip (void)
+{
+        const gchar **security;
+        guint i;
+
+        for (security = securities; *security; security++) {
+                for (i = 0; i < G_N_ELEMENTS (privacys); i++) {
+                        Classification classification = { NULL, NULL };
+                        gchar *subject, *stripped = NULL;
+
+                        subject = mark_subject ("Re: Weekly ops", *security,
+                                                privacys[i]);
+                        g_assert (parse_classification (subject, &classification,
+                                                        &stripped));
+                        g_assert_cmpstr (classification.security, ==, *security);
+                        g_assert_cmpstr (classification.privacy, ==, privacys[i]);
+                        g_assert_cmpstr (stripped, ==, "Re: Weekly ops");
+                        check_subject_properties (subject);
+
+                        g_free (stripped);
+                        g_free (subject);
+                        g_free (classification.security);
+                        g_free (classification.privacy);
+                }
+        }
+}
+
+/* builds a random string out of fragments likely to trip up the parsers */
+static gchar *
+random_input (void)
+{
+        static const gchar *fragments[] = { "[SEC=", "]", "[", ":", ",", " ",
+                                            "SEC=", "sec=", "RESTRICTED",
+                                            "PERSONNEL", "junk", "Re: ", "-",
+                                            "<body>", "<BODY class=x>", "<p>",
+                                            "&", "\n", "\xc3\xa9", "\xff" };
+        GString *input = g_string_new (NULL);
+        gint i, n;
+
+        n = g_test_rand_int_range (0, 24);
+        for (i = 0; i < n; i++) {
+                g_string_append (input,
+                                 fragments[g_test_rand_int_range (0, G_N_ELEMENTS (fragments))]);
+        }
+        return g_string_free (input, FALSE);
+}
+
+static void
+test_random_properties (void)
+{
+        gint i;
+
+        for (i = 0; i < 2000; i++) {
+                gchar *input = random_input ();
+
+                check_subject_properties (input);
+                check_header_properties (input);
+                check_body_properties (input);
+                g_free (input);
+        }
+}
+
+static void
+test_header_round_trip (void)
+{
+        const gchar **security;
+        guint i;
+
+        for (security = securities; *security; security++) {
+                for (i = 0; i < G_N_ELEMENTS (privacys); i++) {
+                        Classification classification = { NULL, NULL };
+                        gchar *header;
+
+                        header = build_protective_marking (*security, privacys[i],
+                                                           "jane.citizen@defence.gov.au");
+                        g_assert (parse_protective_marking (header, &classification));
+                        g_assert_cmpstr (classification.security, ==, *security);
+                        g_assert_cmpstr (classification.privacy, ==, privacys[i]);
+                        check_header_properties (header);
+
+                        g_free (header);
+                        g_free (classification.security);
+                        g_free (classification.privacy);
+                }
+        }
+}
+
+static void
+test_header_examples (void)
+{
+        Classification classification = { NULL, NULL };
+
+        /* values are returned as found - callers validate them */
+        g_assert (parse_protective_marking ("VER=2005.6,NS=gov.au,\n sec=restricted :\n staff ",
+                                            &classification));
+        g_assert_cmpstr (classification.security, ==, "restricted");
+        g_assert_cmpstr (classification.privacy, ==, "staff");
+        g_free (classification.security);
+        g_free (classification.privacy);
+
+        g_assert (!parse_protective_marking ("VER=2005.6, SEC=, ORIGIN=x", &classification));
+        g_assert (!parse_protective_marking ("SEC=:PERSONNEL", &classification));
+        g_assert (!parse_protective_marking ("", &classification));
+        g_assert (!parse_protective_marking (NULL, &classification));
+}
+
+static void
+test_body_html (void)
+{
+        gchar *html;
+
+        html = g_strdup ("<html><body>text</body></html>");
+        insert_marking_html (&html, "RESTRICTED");
+        g_assert_cmpstr (html, ==, "<html><body>\n<p><b>RESTRICTED</b></p>text</body></html>");
+        /* already marked */
+        insert_marking_html (&html, "RESTRICTED");
+        g_assert_cmpstr (html, ==, "<html><body>\n<p><b>RESTRICTED</b></p>text</body></html>");
+        g_free (html);
+
+        /* body may start the document and be in any case */
+        html = g_strdup ("<BODY bgcolor=\"#fff\">text");
+        insert_marking_html (&html, "A&B");
+        g_assert_cmpstr (html, ==, "<BODY bgcolor=\"#fff\">\n<p><b>A&amp;B</b></p>text");
+        g_free (html);
+
+        check_body_properties ("<html><head></head><body>x</body></html>");
+}
+
+static void
+test_body_plain (void)
+{
+        gchar *plain;
+
+        plain = g_strdup ("text");
+        insert_marking_plain (&plain, "RESTRICTED");
+        g_assert_cmpstr (plain, ==, "RESTRICTED\n\ntext");
+        insert_marking_plain (&plain, "RESTRICTED");
+        g_assert_cmpstr (plain, ==, "RESTRICTED\n\ntext");
+        g_free (plain);
+
+        plain = NULL;
+        insert_marking_plain (&plain, "RESTRICTED");
+        g_assert_cmpstr (plain, ==, "RESTRICTED");
+        g_free (plain);
+}
+
+static void
+test_address_in_domain (void)
+{
+        g_assert (address_in_domain ("x@agency.gov.au", "agency.gov.au"));
+        g_assert (address_in_domain ("X@AGENCY.GOV.AU", "agency.gov.au"));
+        g_assert (address_in_domain ("x@mail.agency.gov.au", "agency.gov.au"));
+        g_assert (address_in_domain ("x@agency.gov.au", "@agency.gov.au"));
+        g_assert (!address_in_domain ("x@evil-agency.gov.au", "agency.gov.au"));
+        g_assert (!address_in_domain ("x@agency.gov.au.evil.com", "agency.gov.au"));
+        g_assert (!address_in_domain ("agency.gov.au", "agency.gov.au"));
+        g_assert (!address_in_domain ("x.agency.gov.au", "agency.gov.au"));
+        g_assert (address_in_domain ("x@agency.gov.au", "gov.au"));
+        g_assert (!address_in_domain ("x@agency.gov.au", ""));
+        g_assert (!address_in_domain ("", "agency.gov.au"));
+        g_assert (!address_in_domain (NULL, "agency.gov.au"));
+}
+
+int
+main (int argc, char **argv)
+{
+        g_test_init (&argc, &argv, NULL);
+
+        g_test_add_func ("/marking/subject/examples", test_subject_examples);
+        g_test_add_func ("/marking/subject/invalid-utf8", test_subject_invalid_utf8);
+        g_test_add_func ("/marking/subject/round-trip", test_subject_round_trip);
+        g_test_add_func ("/marking/header/examples", test_header_examples);
+        g_test_add_func ("/marking/header/round-trip", test_header_round_trip);
+        g_test_add_func ("/marking/body/html", test_body_html);
+        g_test_add_func ("/marking/body/plain", test_body_plain);
+        g_test_add_func ("/marking/address-in-domain", test_address_in_domain);
+        g_test_add_func ("/marking/random", test_random_properties);
+
+        return g_test_run ();
+}